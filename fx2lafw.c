@@ -53,6 +53,198 @@ BYTE vendor_command;
 
 volatile WORD ledcounter = 0;
 
+/* Timer2 overflows, one every 125us (500 ticks of CLKOUT / 12). */
+static volatile __xdata uint32_t timer2_overflows = 0;
+
+/* Time CMD_START was processed, see timestamp(). */
+static __xdata uint32_t start_cmd_time;
+
+/*
+ * Selected alternate setting of interface 0 (1: pattern generator, 2: logic
+ * analyzer with the EP1 event and loopback endpoints).
+ */
+static BYTE alt_setting = 0;
+
+/* Send an EVENT_SOF every sof_interval (micro)frames, 0 = never. */
+static uint8_t sof_interval = 0;
+static uint8_t sof_count;
+static uint8_t sof_dropped;
+
+#ifndef FX2LAFW_NO_FREQ_METER
+/*
+ * Frequency meter on INT0 (PA0), see CMD_SET_FREQ_METER. Edges are
+ * counted by ie0_isr(), the high time by timer0 (gated by INT0), and
+ * timer2_isr() closes the gate every freq_gate overflows.
+ */
+static __xdata uint16_t freq_gate = 0;
+static __xdata uint16_t freq_ticks;
+static volatile __xdata uint32_t freq_edges, freq_first, freq_last;
+static volatile __xdata uint16_t timer0_overflows;
+static __xdata uint32_t freq_high_start, freq_window_start;
+static __xdata struct event_freq freq_ev;
+static volatile BOOL freq_ready;
+#endif
+
+/*
+ * Return a free running timestamp in timer2 ticks (0.25us at 48MHz).
+ * Interrupts are disabled, so this may also be called from ISRs. It is
+ * reentrant, so its locals aren't overlaid with those of the main loop,
+ * and multiplies by shifting, as _mullong isn't reentrant.
+ */
+static uint32_t timestamp(void) __reentrant __critical
+{
+	BYTE h, l;
+	uint16_t t;
+	uint32_t ovf = timer2_overflows;
+
+	do {
+		h = TH2;
+		l = TL2;
+	} while (h != TH2);
+	t = ((uint16_t)h << 8) | l;
+
+	/* Account for an overflow whose interrupt is still pending. */
+	if (TF2 && t < (uint16_t)(-500 + 250))
+		ovf++;
+
+	/* ovf * 500 */
+	ovf = (ovf << 9) - (ovf << 3) - (ovf << 2);
+
+	return ovf + (uint16_t)(t + 500);
+}
+
+#ifndef FX2LAFW_NO_FREQ_METER
+/*
+ * Return the time INT0 was high, in timer0 ticks (0.25us at 48MHz).
+ * Called from timer2_isr(), see timestamp().
+ */
+static uint32_t timer0_count(void) __reentrant __critical
+{
+	BYTE h, l;
+	uint16_t t;
+	uint16_t ovf = timer0_overflows;
+
+	do {
+		h = TH0;
+		l = TL0;
+	} while (h != TH0);
+	t = ((uint16_t)h << 8) | l;
+
+	/* Account for an overflow whose interrupt is still pending. */
+	if (TF0 && t < 0x8000)
+		ovf++;
+
+	return ((uint32_t)ovf << 16) | t;
+}
+
+/* Called from timer2_isr(), see timestamp(). */
+static void put_be32(__xdata uint8_t *p, uint32_t v) __reentrant
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void set_freq_meter(uint16_t ms)
+{
+	EX0 = 0;
+	ET0 = 0;
+	TR0 = 0;
+	freq_gate = 0;
+	freq_ready = FALSE;
+	PORTACFG &= ~bmINT0;
+
+	if (!ms)
+		return;
+	if (ms > 8191)
+		ms = 8191;
+
+	OEA &= ~bmINT0;
+	PORTACFG |= bmINT0;
+
+	/* Timer0: 16 bit, counts CLKOUT / 12 while INT0 is high (GATE). */
+	TMOD = (TMOD & 0xf0) | 0x09;
+	TH0 = 0;
+	TL0 = 0;
+	TF0 = 0;
+	timer0_overflows = 0;
+	freq_high_start = 0;
+
+	freq_edges = 0;
+	freq_ticks = 0;
+	freq_ev.type = EVENT_FREQ;
+	freq_ev.dropped = 0;
+	freq_window_start = timestamp();
+
+	/* Count falling edges with high priority, like edge timestamps. */
+	IT0 = 1;
+	IE0 = 0;
+	PX0 = 1;
+	TR0 = 1;
+	ET0 = 1;
+	EX0 = 1;
+
+	/* 8 timer2 overflows per ms. */
+	freq_gate = ms * 8;
+}
+
+/* Close the gate, called from timer2_isr(). */
+static void freq_snapshot(void) __critical
+{
+	uint32_t now = timestamp();
+	uint32_t high = timer0_count();
+
+	/* The host didn't fetch the previous record. */
+	if (freq_ready && freq_ev.dropped < 255)
+		freq_ev.dropped++;
+
+	put_be32(freq_ev.edges, freq_edges);
+	put_be32(freq_ev.span, freq_edges ? freq_last - freq_first : 0);
+	put_be32(freq_ev.high, high - freq_high_start);
+	put_be32(freq_ev.window, now - freq_window_start);
+	freq_ready = TRUE;
+
+	freq_edges = 0;
+	freq_high_start = high;
+	freq_window_start = now;
+}
+
+/*
+ * Send the last record once EP1 IN is free. sof_isr() uses EP1 IN, too,
+ * and timer2_isr() writes the record, so both interrupts (only) are
+ * masked while checking EP1 IN and copying the record.
+ */
+static void send_freq_event(void)
+{
+	BYTE sof = USBIE & bmSOF;
+	BYTE i;
+
+	USBIE &= ~bmSOF;
+	ET2 = 0;
+	if (!(EP1INCS & bmEPBUSY)) {
+		for (i = 0; i < sizeof(struct event_freq); i++)
+			EP1INBUF[i] = ((__xdata BYTE *)&freq_ev)[i];
+		EP1INBC = sizeof(struct event_freq);
+
+		freq_ev.dropped = 0;
+		freq_ready = FALSE;
+	}
+	ET2 = 1;
+	USBIE |= sof;
+}
+#endif
+
+static void record_start_delay(void)
+{
+	uint32_t delay = timestamp() - start_cmd_time;
+
+	gpif_info.start_delay[0] = delay >> 24;
+	gpif_info.start_delay[1] = delay >> 16;
+	gpif_info.start_delay[2] = delay >> 8;
+	gpif_info.start_delay[3] = delay;
+}
+
 static void setup_endpoints(void)
 {
 	/* Setup EP2 (IN). */
@@ -64,11 +256,17 @@ static void setup_endpoints(void)
 		 (0u << 1) | (0u << 0);	  /* EP buffering: quad buffering */
 	SYNCDELAY();
 
-	/* Disable all other EPs (EP1, EP4, EP6, and EP8). */
-	EP1INCFG &= ~bmVALID;
+	/* Setup EP1 (IN), used for event records. */
+	EP1INCFG = bmVALID | (1u << 5) | (1u << 4); /* EP Type: interrupt */
 	SYNCDELAY();
-	EP1OUTCFG &= ~bmVALID;
+
+	/* Setup EP1 (OUT), used for loopback, and arm it. */
+	EP1OUTCFG = bmVALID | (1u << 5); /* EP Type: bulk */
 	SYNCDELAY();
+	EP1OUTBC = 0;
+	SYNCDELAY();
+
+	/* Disable all other EPs (EP4, EP6, and EP8). */
 	EP4CFG &= ~bmVALID;
 	SYNCDELAY();
 	EP6CFG &= ~bmVALID;
@@ -124,11 +322,114 @@ static void send_revid_version(void)
 	SYNCDELAY();
 }
 
+extern __code BYTE dev_strings;
+
+static const uint16_t max_rates_khz[4] = { 24000, 12000, 1000, 500 };
+
+static void send_capabilities(void)
+{
+	struct capabilities_info *const ci = (struct capabilities_info *)EP0BUF;
+	__code BYTE *s = &dev_strings;
+	BYTE *name = (BYTE *)EP0BUF + sizeof(struct capabilities_info);
+	BYTE i, len;
+
+	/* Populate the buffer. */
+	ci->major = FX2LAFW_VERSION_MAJOR;
+	ci->minor = FX2LAFW_VERSION_MINOR;
+	ci->start_flags = CMD_START_FLAGS_IMMEDIATE |
+			  CMD_START_FLAGS_SYNC_MASTER |
+			  CMD_START_FLAGS_SYNC_SLAVE |
+			  CMD_START_FLAGS_INTERLEAVE |
+			  CMD_START_FLAGS_CLK_CTL2 |
+			  CMD_START_FLAGS_SAMPLE_16BIT |
+			  CMD_START_FLAGS_CLK_48MHZ;
+	ci->flags = 0;
+	if (IFCONFIG & bm3048MHZ)
+		ci->flags |= CAPS_FLAGS_CLK_48MHZ;
+	if (USBCS & bmHSM)
+		ci->flags |= CAPS_FLAGS_HIGH_SPEED;
+	ci->flags |= CAPS_FLAGS_FRAC_PERIOD | CAPS_FLAGS_SAMPLE_COUNT |
+		     CAPS_FLAGS_SOF_EVENTS | CAPS_FLAGS_GENERATOR;
+	ci->flags2 = CAPS_FLAGS2_LOOPBACK | CAPS_FLAGS2_STOP;
+
+	/* The optional modes, if built in. */
+#ifndef FX2LAFW_NO_TEST_PATTERN
+	ci->flags |= CAPS_FLAGS_TEST_PATTERN;
+#endif
+#ifndef FX2LAFW_NO_EDGE_TIMESTAMPS
+	ci->flags |= CAPS_FLAGS_EDGE_TIMESTAMPS;
+#endif
+#ifndef FX2LAFW_NO_FREQ_METER
+	ci->flags2 |= CAPS_FLAGS2_FREQ_METER;
+#endif
+#ifndef FX2LAFW_NO_UART_SNIFFER
+	ci->flags2 |= CAPS_FLAGS2_UART_SNIFFER;
+#endif
+	ci->period_min_h = GPIF_PERIOD_MIN >> 8;
+	ci->period_min_l = GPIF_PERIOD_MIN & 0xff;
+	ci->period_max_h = GPIF_PERIOD_MAX >> 8;
+	ci->period_max_l = GPIF_PERIOD_MAX & 0xff;
+	for (i = 0; i < 4; i++) {
+		ci->max_rate_khz[i][0] = max_rates_khz[i] >> 8;
+		ci->max_rate_khz[i][1] = max_rates_khz[i] & 0xff;
+	}
+	ci->fifo_bufs = 4;
+	ci->fifo_size_h = 0x04;
+	ci->fifo_size_l = 0x00;
+	ci->queue_depth = GPIF_QUEUE_LEN;
+
+	/*
+	 * The board name is string descriptor 3. Skip the preceding ones
+	 * and copy the low bytes of its UTF-16 characters.
+	 */
+	for (i = 0; i < 3; i++)
+		s += s[0];
+	len = (s[0] - 2) / 2;
+	if (len > 64 - sizeof(struct capabilities_info))
+		len = 64 - sizeof(struct capabilities_info);
+	for (i = 0; i < len; i++)
+		name[i] = s[2 + 2 * i];
+	ci->name_len = len;
+
+	/* Send the message. */
+	EP0BCH = 0;
+	SYNCDELAY();
+	EP0BCL = sizeof(struct capabilities_info) + len;
+	SYNCDELAY();
+}
+
+static void send_acquisition_info(void)
+{
+	BYTE i;
+
+	/* Populate the buffer. */
+	struct acquisition_info *const ai = (struct acquisition_info *)EP0BUF;
+	ai->status = gpif_acquiring;
+	ai->flags = gpif_info.flags;
+	ai->period_h = gpif_info.period_h;
+	ai->period_l = gpif_info.period_l;
+	ai->period_num = gpif_info.period_num;
+	ai->period_den = gpif_info.period_den;
+	ai->jitter = gpif_info.jitter;
+	ai->error = gpif_info.error;
+	for (i = 0; i < 4; i++) {
+		ai->start_delay[i] = gpif_info.start_delay[i];
+		ai->sample_count[i] = gpif_info.sample_count[i];
+	}
+
+	/* Send the message. */
+	EP0BCH = 0;
+	SYNCDELAY();
+	EP0BCL = sizeof(struct acquisition_info);
+	SYNCDELAY();
+}
+
 BOOL handle_vendorcommand(BYTE cmd)
 {
 	/* Protocol implementation */
 	switch (cmd) {
 	case CMD_START:
+	case CMD_QUEUE_ACQUISITION:
 		/* Tell hardware we are ready to receive data. */
 		vendor_command = cmd;
 		EP0BCL = 0;
@@ -140,6 +441,24 @@ BOOL handle_vendorcommand(BYTE cmd)
 	case CMD_GET_REVID_VERSION:
 		send_revid_version();
 		return TRUE;
+	case CMD_GET_CAPABILITIES:
+		send_capabilities();
+		return TRUE;
+	case CMD_GET_ACQUISITION_INFO:
+		send_acquisition_info();
+		return TRUE;
+#ifndef FX2LAFW_NO_FREQ_METER
+	case CMD_SET_FREQ_METER:
+		/* INT0 is taken by edge timestamps, until CMD_STOP. */
+		if (alt_setting != 2 || gpif_edges_active())
+			return FALSE;
+		set_freq_meter(((uint16_t)SETUPDAT[3] << 8) | SETUPDAT[2]);
+		return TRUE;
+#endif
+	case CMD_STOP:
+		USBIE &= ~bmSOF;
+		gpif_acquisition_stop();
+		return TRUE;
 	}
 
 	return FALSE;
@@ -147,32 +466,60 @@ BOOL handle_vendorcommand(BYTE cmd)
 
 BOOL handle_get_interface(BYTE ifc, BYTE *alt_ifc)
 {
-	/* We only support interface 0, alternate interface 0. */
+	/* We only support interface 0. */
 	if (ifc != 0)
 		return FALSE;
 
-	*alt_ifc = 0;
+	*alt_ifc = alt_setting;
 	return TRUE;
 }
 
 BOOL handle_set_interface(BYTE ifc, BYTE alt_ifc)
 {
-	/* We only support interface 0, alternate interface 0. */
-	if (ifc != 0 || alt_ifc != 0)
+	/*
+	 * We only support interface 0, alternate interface 0 (logic
+	 * analyzer), 1 (pattern generator, EP2 OUT) and 2 (logic analyzer
+	 * with EP1 IN/OUT). EP1 is kept out of alternate setting 0, so the
+	 * interrupt endpoint only reserves bus time when it is used.
+	 */
+	if (ifc != 0 || alt_ifc > 2)
 		return FALSE;
 
+#ifndef FX2LAFW_NO_FREQ_METER
+	/* EVENT_FREQ records can't be sent without EP1 IN. */
+	if (alt_ifc != 2 && freq_gate)
+		set_freq_meter(0);
+#endif
+
 	/* Perform procedure from TRM, section 2.3.7: */
 
-	/* (1) TODO. */
+	/* (1) Reconfigure EP2 for the selected direction. */
+	alt_setting = alt_ifc;
+	if (alt_ifc == 1) {
+		EP2CFG = (1u << 7) |		  /* EP is valid/activated */
+			 (0u << 6) |		  /* EP direction: OUT */
+			 (1u << 5) | (0u << 4) |  /* EP Type: bulk */
+			 (0u << 3) |		  /* EP buffer size: 512 */
+			 (0u << 1) | (0u << 0);	  /* EP buffering: quad */
+	} else {
+		EP2CFG = (1u << 7) |		  /* EP is valid/activated */
+			 (1u << 6) |		  /* EP direction: IN */
+			 (1u << 5) | (0u << 4) |  /* EP Type: bulk */
+			 (1u << 3) |		  /* EP buffer size: 1024 */
+			 (0u << 1) | (0u << 0);	  /* EP buffering: quad */
+	}
+	SYNCDELAY();
 
 	/* (2) Reset data toggles of the EPs in the interface. */
 	/* Note: RESETTOGGLE() gets the EP number WITH bit 7 set/cleared. */
-	RESETTOGGLE(0x82);
+	RESETTOGGLE(alt_ifc == 1 ? 0x02 : 0x82);
+	if (alt_ifc == 2) {
+		RESETTOGGLE(0x81);
+		RESETTOGGLE(0x01);
+	}
 
 	/* (3) Restore EPs to their default conditions. */
-	/* Note: RESETFIFO() gets the EP number WITHOUT bit 7 set/cleared. */
-	RESETFIFO(0x02);
-	/* TODO */
+	gpif_set_generator(alt_ifc == 1);
 
 	/* (4) Clear the HSNAK bit. Not needed, fx2lib does this. */
 
@@ -216,7 +563,8 @@ void ibn_isr(void) __interrupt(IBN_ISR)
 	if ((IBNIRQ & bmEP2IBN) && (gpif_acquiring == PREPARED)) {
 		ledcounter = 1;
 		LED_OFF();
-		gpif_acquisition_start();
+		if (gpif_acquisition_start())
+			record_start_delay();
 	}
 
 	/* Clear IBN flags for all EPs. */
@@ -229,6 +577,133 @@ void ibn_isr(void) __interrupt(IBN_ISR)
 	SYNCDELAY();
 }
 
+static void send_sof_event(void)
+{
+	struct event_sof *const ev = (struct event_sof *)EP1INBUF;
+	uint32_t index = gpif_sample_index();
+
+	/* Drop the record if the host didn't fetch the previous one yet. */
+	if (EP1INCS & bmEPBUSY) {
+		sof_dropped++;
+		return;
+	}
+
+	ev->type = EVENT_SOF;
+	ev->dropped = sof_dropped;
+	ev->frame_h = USBFRAMEH;
+	ev->frame_l = USBFRAMEL;
+	ev->microframe = MICROFRAME;
+	ev->sample_index[0] = index >> 24;
+	ev->sample_index[1] = index >> 16;
+	ev->sample_index[2] = index >> 8;
+	ev->sample_index[3] = index;
+	EP1INBC = sizeof(struct event_sof);
+}
+
+/*
+ * Echo the packet received on EP1 OUT on EP1 IN, once EP1 IN is free.
+ * sof_isr() uses EP1 IN, too, so the SOF interrupt (only) is masked while
+ * checking and filling it.
+ */
+static void send_loopback_event(void)
+{
+	struct event_loopback *const ev = (struct event_loopback *)EP1INBUF;
+	BYTE sof = USBIE & bmSOF;
+	uint32_t t;
+	BYTE i, len;
+
+	USBIE &= ~bmSOF;
+	if (EP1INCS & bmEPBUSY) {
+		USBIE |= sof;
+		return;
+	}
+
+	t = timestamp();
+	len = EP1OUTBC;
+	if (len > LOOPBACK_PAYLOAD_MAX)
+		len = LOOPBACK_PAYLOAD_MAX;
+
+	ev->type = EVENT_LOOPBACK;
+	ev->len = len;
+	ev->timestamp[0] = t >> 24;
+	ev->timestamp[1] = t >> 16;
+	ev->timestamp[2] = t >> 8;
+	ev->timestamp[3] = t;
+	for (i = 0; i < len; i++)
+		EP1INBUF[sizeof(struct event_loopback) + i] = EP1OUTBUF[i];
+	EP1INBC = sizeof(struct event_loopback) + len;
+
+	/* Re-arm EP1 OUT. */
+	EP1OUTBC = 0;
+
+	USBIE |= sof;
+}
+
+void sof_isr(void) __interrupt(SOF_ISR)
+{
+	if (gpif_acquiring == RUNNING && ++sof_count >= sof_interval) {
+		sof_count = 0;
+		send_sof_event();
+	}
+
+	CLEAR_SOF();
+}
+
+#if !defined(FX2LAFW_NO_EDGE_TIMESTAMPS) || !defined(FX2LAFW_NO_FREQ_METER)
+/*
+ * Falling edge on INT0 (PA0), only enabled for edge timestamps and the
+ * frequency meter.
+ */
+void ie0_isr(void) __interrupt(IE0_ISR)
+{
+	uint32_t t = timestamp();
+
+#ifndef FX2LAFW_NO_FREQ_METER
+	if (freq_gate) {
+		if (freq_edges++ == 0)
+			freq_first = t;
+		freq_last = t;
+		return;
+	}
+#endif
+
+#ifndef FX2LAFW_NO_EDGE_TIMESTAMPS
+	gpif_record_edge(t);
+#endif
+}
+#endif
+
+#ifndef FX2LAFW_NO_UART_SNIFFER
+/* UART sniffer, only enabled while it runs. */
+void ri_0_isr(void) __interrupt(TI_0_ISR)
+{
+	if (RI) {
+		RI = 0;
+		gpif_record_uart(RB8 ? 0 : UART_RECORD_FRAMING_ERROR, SBUF0,
+				 timestamp());
+	}
+	TI = 0;
+}
+
+void ri_1_isr(void) __interrupt(TI_1_ISR)
+{
+	if (RI1) {
+		RI1 = 0;
+		gpif_record_uart(UART_RECORD_PORT1 |
+				 (RB81 ? 0 : UART_RECORD_FRAMING_ERROR),
+				 SBUF1, timestamp());
+	}
+	TI1 = 0;
+}
+#endif
+
+#ifndef FX2LAFW_NO_FREQ_METER
+void tf0_isr(void) __interrupt(TF0_ISR)
+{
+	timer0_overflows++;
+}
+#endif
+
 void usbreset_isr(void) __interrupt(USBRESET_ISR)
 {
 	handle_hispeed(FALSE);
@@ -243,6 +718,15 @@ void hispeed_isr(void) __interrupt(HISPEED_ISR)
 
 void timer2_isr(void) __interrupt(TF2_ISR)
 {
+	/*
+	 * Atomically, the INT0 handler (high priority) must not see the
+	 * new count with TF2 still set, or the old one with TF2 cleared.
+	 */
+	__critical {
+		TF2 = 0;
+		timer2_overflows++;
+	}
+
 	/* Blink LED during acquisition, keep it on otherwise. */
 	if (gpif_acquiring == RUNNING) {
 		if (--ledcounter == 0) {
@@ -252,7 +736,14 @@ void timer2_isr(void) __interrupt(TF2_ISR)
 	} else if (gpif_acquiring == STOPPED) {
 		LED_ON();
 	}
-	TF2 = 0;
+
+#ifndef FX2LAFW_NO_FREQ_METER
+	/* Not before clearing TF2, timestamp() would count it twice. */
+	if (freq_gate && ++freq_ticks >= freq_gate) {
+		freq_ticks = 0;
+		freq_snapshot();
+	}
+#endif
 }
 
 void fx2lafw_init(void)
@@ -296,8 +787,58 @@ void fx2lafw_init(void)
 	gpif_init_la();
 }
 
+static void start_acquisition(const struct cmd_start_acquisition *cmd)
+{
+	start_cmd_time = timestamp();
+
+#ifndef FX2LAFW_NO_FREQ_METER
+	/* The frequency meter would compete for INT0. */
+	set_freq_meter(0);
+#endif
+
+	/* End the previous acquisition, the CPU sourced ones run forever. */
+	gpif_acquisition_stop();
+
+	/*
+	 * SOF events are only enabled on request, to save CPU cycles, and
+	 * only sent in alternate setting 2 (with EP1 IN).
+	 */
+	sof_interval = (alt_setting == 2) ? cmd->sof_interval : 0;
+	sof_count = 0;
+	sof_dropped = 0;
+	if (sof_interval)
+		ENABLE_SOF();
+	else
+		USBIE &= ~bmSOF;
+
+	if (!gpif_acquisition_prepare(cmd))
+		return;
+
+	/*
+	 * Usually the GPIF is started by ibn_isr(), when the host requests
+	 * the first data. Start it right away if the host asked for a
+	 * deterministic start time instead.
+	 */
+	if (!(cmd->flags & CMD_START_FLAGS_IMMEDIATE))
+		return;
+
+	/* Don't race with ibn_isr(). */
+	__critical {
+		if (gpif_acquiring == PREPARED) {
+			ledcounter = 1;
+			LED_OFF();
+			if (gpif_acquisition_start())
+				record_start_delay();
+		}
+	}
+}
+
 void fx2lafw_poll(void)
 {
+	const struct cmd_start_acquisition *const cmd =
+		(const struct cmd_start_acquisition *)EP0BUF;
+	BYTE i;
+
 	if (got_sud) {
 		handle_setupdata();
 		got_sud = FALSE;
@@ -306,12 +847,19 @@ void fx2lafw_poll(void)
 	if (vendor_command) {
 		switch (vendor_command) {
 		case CMD_START:
+		case CMD_QUEUE_ACQUISITION:
 			if ((EP0CS & bmEPBUSY) != 0)
 				break;
 
-			if (EP0BCL == sizeof(struct cmd_start_acquisition)) {
-				gpif_acquisition_prepare(
-				 (const struct cmd_start_acquisition *)EP0BUF);
+			if (EP0BCL >= CMD_START_LEN_MIN &&
+			    EP0BCL <= CMD_START_LEN_MAX) {
+				/* Zero the optional fields the host omitted. */
+				for (i = EP0BCL; i < CMD_START_LEN_MAX; i++)
+					EP0BUF[i] = 0;
+				if (vendor_command == CMD_START)
+					start_acquisition(cmd);
+				else
+					gpif_acquisition_queue(cmd);
 			}
 
 			/* Acknowledge the vendor command. */
@@ -324,6 +872,15 @@ void fx2lafw_poll(void)
 		}
 	}
 
+#ifndef FX2LAFW_NO_FREQ_METER
+	if (freq_ready)
+		send_freq_event();
+#endif
+
+	/* Echo loopback packets as soon as EP1 IN is free. */
+	if (!(EP1OUTCS & bmEPBUSY))
+		send_loopback_event();
+
 	gpif_poll();
 }
 
@@ -27,6 +27,82 @@
 #include <gpif-acquisition.h>
 
 enum gpif_status gpif_acquiring = STOPPED;
+__xdata struct acquisition_info gpif_info;
+
+/* Sample period of the waveform being built, in IFCLK ticks. */
+static __xdata uint16_t period_ticks;
+
+/* Logic function of the decision point, see gpif_acquisition_prepare(). */
+static uint8_t dp_logic;
+
+/* First state of the sampling loop (S1 if there's a sync wait state). */
+static uint8_t loop_start;
+
+/* CTL outputs driven in all states (sync trigger output). */
+static uint8_t ctl_out;
+
+/* Sample count of the prepared acquisition, 0 means unlimited. */
+static __xdata uint8_t sample_count[4];
+
+/* Configurations to switch to when a sample limited acquisition ends. */
+static __xdata struct cmd_start_acquisition queue[GPIF_QUEUE_LEN];
+static uint8_t queue_len;
+static uint8_t segment;
+static bool marker_pending;
+
+/* The tail of a sample limited acquisition waits for the host to read it. */
+static bool draining;
+
+/* Stream tag to send on start of an interleaved capture, see prepare(). */
+static bool tag_pending;
+static uint8_t tag_role;
+static __xdata uint16_t tag_offset;
+
+/*
+ * CPU sourced modes, only those built in (see fx2lafw.h) are accepted by
+ * gpif_pattern_prepare().
+ */
+static uint8_t pattern;
+static bool edges;
+static bool uarts;
+
+#ifndef FX2LAFW_NO_TEST_PATTERN
+/* Test pattern replacing the GPIF as data source, see gpif_pattern_poll(). */
+static uint8_t pattern_fill;
+static uint8_t pattern_pos;
+static __xdata uint16_t pattern_lfsr;
+static __xdata uint32_t pattern_left;
+#define PATTERN_MAX		TEST_PATTERN_LFSR
+#else
+#define PATTERN_MAX		TEST_PATTERN_NONE
+#endif
+
+#ifndef FX2LAFW_NO_EDGE_TIMESTAMPS
+/* Edge timestamps, filled by gpif_record_edge() (INT0 handler). */
+static __xdata struct edge_record edge_ring[GPIF_RING_LEN];
+static volatile uint8_t edge_head, edge_tail;
+static uint8_t edge_lost;
+#define EDGE_INPUT_MAX		EDGE_INPUT_INT0
+#else
+#define EDGE_INPUT_MAX		0
+#endif
+
+#ifndef FX2LAFW_NO_UART_SNIFFER
+/* UART sniffer, filled by gpif_record_uart() (serial port handlers). */
+static __xdata struct uart_record uart_ring[GPIF_RING_LEN];
+static volatile uint8_t uart_head, uart_tail;
+static bool uart_lost;
+static __xdata uint8_t uart_flags, uart_reload;
+#endif
+
+/* EP2 is an OUT endpoint, drive its data onto the pins instead. */
+static bool generator;
+
+/* Pattern generator loop mode, see gpif_loop_poll(). */
+static bool gen_loop;
+static __xdata uint8_t loop_buf[GEN_LOOP_MAX];
+static uint8_t loop_n;
+static __xdata uint16_t loop_len;
 
 static void gpif_reset_waveforms(void)
 {
@@ -132,21 +208,23 @@ static void gpif_make_delay_state(volatile BYTE *pSTATE, uint8_t delay, uint8_t
 {
 	/*
 	 * DELAY
-	 * Delay cmd->sample_delay clocks.
+	 * Delay cmd->sample_delay clocks. A delay of 0 means 256 clocks.
 	 */
 	pSTATE[0] = delay;
+	period_ticks += delay ? delay : 256;
 
 	/*
 	 * OPCODE
 	 * SGL=0, GIN=0, INCAD=0, NEXT=0, DATA=0, DP=0
+	 * The pattern generator keeps driving the bus (DATA=1).
 	 */
-	pSTATE[8] = 0;
+	pSTATE[8] = generator ? (1 << 1) : 0;
 
 	/*
 	 * OUTPUT
 	 * CTL[0:5]=output
 	 */
-	pSTATE[16] = output;
+	pSTATE[16] = output | ctl_out;
 
 	/*
 	 * LOGIC FUNCTION
@@ -159,15 +237,55 @@ static void gpif_make_data_dp_state(volatile BYTE *pSTATE)
 {
 	/*
 	 * BRANCH
-	 * Branch to IDLE if condition is true, back to S0 otherwise.
+	 * Branch to IDLE if condition is true, back to the start of the
+	 * sampling loop otherwise.
 	 */
-	pSTATE[0] = (1u << 7) | (7u << 3) | (0u << 0);
+	pSTATE[0] = (1u << 7) | (7u << 3) | loop_start;
 
 	/*
 	 * OPCODE
 	 * SGL=0, GIN=0, INCAD=0, NEXT=0, DATA=1, DP=1
+	 * The pattern generator advances to the next sample (NEXT=1),
+	 * which is driven for the following period.
 	 */
 	pSTATE[8] = (1 << 1) | (1 << 0);
+	if (generator)
+		pSTATE[8] |= (1 << 2);
+
+	/*
+	 * OUTPUT
+	 * CTL[0:5]=ctl_out
+	 */
+	pSTATE[16] = ctl_out;
+
+	/*
+	 * LOGIC FUNCTION
+	 * Evaluate if the FIFO full flag is set (and, for sample limited
+	 * acquisitions, if the transaction count expired).
+	 */
+	pSTATE[24] = dp_logic;
+
+	/* The decision point itself takes one clock. */
+	period_ticks++;
+}
+
+/*
+ * Sync slaves wait in S0 until the master raises its trigger output
+ * (CTL0), which is wired to RDY0 of all slaves.
+ */
+static void gpif_make_sync_wait_state(volatile BYTE *pSTATE)
+{
+	/*
+	 * BRANCH
+	 * Branch to S1 if RDY0 is set, stay in S0 otherwise.
+	 */
+	pSTATE[0] = (1u << 3) | (0u << 0);
+
+	/*
+	 * OPCODE
+	 * SGL=0, GIN=0, INCAD=0, NEXT=0, DATA=0, DP=1
+	 */
+	pSTATE[8] = (1 << 0);
 
 	/*
 	 * OUTPUT
@@ -177,29 +295,475 @@ static void gpif_make_data_dp_state(volatile BYTE *pSTATE)
 
 	/*
 	 * LOGIC FUNCTION
-	 * Evaluate if the FIFO full flag is set.
-	 * LFUNC=0 (AND), TERMA=6 (FIFO Flag), TERMB=6 (FIFO Flag)
+	 * LFUNC=0 (AND), TERMA=0 (RDY0), TERMB=0 (RDY0)
+	 */
+	pSTATE[24] = (0 << 3) | (0 << 0);
+}
+
+static void gpif_make_data_state(volatile BYTE *pSTATE, uint8_t delay)
+{
+	gpif_make_delay_state(pSTATE, delay, 0x00);
+
+	/*
+	 * OPCODE
+	 * SGL=0, GIN=0, INCAD=0, NEXT=0, DATA=1, DP=0
 	 */
-	pSTATE[24] = (6 << 3) | (6 << 0);
+	pSTATE[8] = (1 << 1);
+}
+
+/*
+ * Pick the den (2..max_den) that best approximates frac / 256
+ * as num / den. Returns num, or 0 if no fractional part remains.
+ */
+static uint8_t gpif_frac_approx(uint8_t frac, uint8_t max_den,
+		uint8_t *den)
+{
+	uint8_t d, num, best_num = 0;
+	uint16_t err, best_err = 0xffff;
+
+	for (d = 2; d <= max_den; d++) {
+		num = ((uint16_t)frac * d + 128) >> 8;
+		err = (uint16_t)frac * d - (uint16_t)num * 256;
+		if ((int16_t)err < 0)
+			err = -err;
+		/* Scale by 60 / d to compare errors across denominators. */
+		err *= 60 / d;
+		if (err < best_err) {
+			best_err = err;
+			best_num = num;
+			*den = d;
+		}
+	}
+
+	return best_num;
+}
+
+/*
+ * Build a waveform that takes den samples per pass, num of which are
+ * one tick longer than period. The longer samples are spread evenly
+ * (Bresenham style), so the average period is period + num / den and no
+ * sample deviates from the ideal grid by more than one tick.
+ *
+ * Samples 0..den-2 are taken by non-decision-point data states, the last
+ * one by the decision point, preceded by a delay state. The FIFO full
+ * flag is thus only evaluated once per pass.
+ */
+static void gpif_make_frac_states(volatile BYTE *pSTATE, uint8_t period,
+		uint8_t num, uint8_t den)
+{
+	uint8_t i, acc = 0, len;
+
+	for (i = 0; i < den; i++) {
+		len = period;
+		acc += num;
+		if (acc >= den) {
+			acc -= den;
+			len++;
+		}
+
+		if (i < den - 1) {
+			gpif_make_data_state(pSTATE++, len);
+		} else {
+			gpif_make_delay_state(pSTATE++, len - 1, 0x00);
+			gpif_make_data_dp_state(pSTATE);
+		}
+	}
+}
+
+/*
+ * TCXpire is only evaluated by the decision point, i.e. once per pass of
+ * den samples, so round the sample count up to a multiple of den. Only
+ * 16 bit arithmetic, byte by byte. Returns false if it would overflow.
+ */
+static bool gpif_round_count(uint8_t den)
+{
+	uint16_t r = 0;
+	uint8_t i;
+
+	for (i = 0; i < 4; i++)
+		r = ((r << 8) | sample_count[i]) % den;
+	if (!r)
+		return true;
+
+	r = den - r;
+	for (i = 4; i-- > 0;) {
+		r += sample_count[i];
+		sample_count[i] = r & 0xff;
+		r >>= 8;
+	}
+
+	return r == 0;
+}
+
+static void gpif_reset_fifo(void)
+{
+	uint8_t i;
+
+	/* Activate NAK-ALL to avoid race conditions. */
+	FIFORESET = 0x80;
+	SYNCDELAY();
+
+	/* Switch to manual mode. */
+	EP2FIFOCFG = 0;
+	SYNCDELAY();
+
+	/* Reset EP2. */
+	FIFORESET = 0x02;
+	SYNCDELAY();
+
+	/* Arm the four OUT buffers (skip them) before going to auto mode. */
+	if (generator) {
+		for (i = 0; i < 4; i++) {
+			OUTPKTEND = 0x82;	/* SKIP, EP2 */
+			SYNCDELAY();
+		}
+	}
+
+	/* Return to auto mode. */
+	EP2FIFOCFG = generator ? bmAUTOOUT : bmAUTOIN;
+	SYNCDELAY();
+
+	/* Release NAK-ALL. */
+	FIFORESET = 0x00;
+	SYNCDELAY();
+}
+
+/*
+ * Wait for the GPIF to become idle. If it doesn't within
+ * GPIF_IDLE_TIMEOUT polls, abort the waveform, reset the EP2 FIFO and
+ * record the failure, instead of hanging the main loop (and with it
+ * the setup packet handling) forever.
+ */
+static bool gpif_wait_idle(void)
+{
+	uint16_t timeout = GPIF_IDLE_TIMEOUT;
+
+	while (!(GPIFTRIG & 0x80)) {
+		if (--timeout == 0) {
+			GPIFABORT = 0xff;
+			SYNCDELAY();
+			gpif_reset_fifo();
+			gpif_info.error = ACQ_ERR_GPIF_TIMEOUT;
+			gpif_acquiring = STOPPED;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Switch EP2 between IN (logic analyzer) and OUT (pattern generator),
+ * after the host selected the matching alternate setting. EP2CFG has to
+ * be set up by the caller.
+ */
+void gpif_set_generator(bool on)
+{
+	GPIFABORT = 0xff;
+	SYNCDELAY();
+
+	generator = on;
+	draining = false;
+	gpif_reset_fifo();
+	gpif_acquiring = STOPPED;
+
+	/* Flag the GPIF evaluates: EP2 FIFO full or empty. */
+	EP2GPIFFLGSEL = on ? 0x01 : 0x02;
+	SYNCDELAY();
+
+	/* Keep driving the last sample when the generator stops. */
+	GPIFIDLECS = on ? (1 << 0) : (0 << 0);
+}
+
+/*
+ * Loop mode: the host sends the pattern as a single packet, which is kept
+ * in RAM. Buffers the GPIF output go back to the USB side and can't be
+ * committed again, so every further packet the host sends (zero-length
+ * ones will do) is overwritten by the CPU with the pattern, replicated
+ * to fill a whole buffer, and committed to the GPIF instead.
+ */
+static void gpif_loop_poll(void)
+{
+	uint16_t i;
+	uint8_t j;
+
+	/* Only buffers holding a packet from the host belong to the CPU. */
+	if (EP2CS & bmEPEMPTY)
+		return;
+
+	if (!loop_n) {
+		loop_n = EP2BCH ? GEN_LOOP_MAX : EP2BCL;
+		if (loop_n > GEN_LOOP_MAX)
+			loop_n = GEN_LOOP_MAX;
+		if (!loop_n) {
+			OUTPKTEND = 0x82;	/* SKIP, EP2 */
+			SYNCDELAY();
+			return;
+		}
+		for (j = 0; j < loop_n; j++)
+			loop_buf[j] = EP2FIFOBUF[j];
+		loop_len = (GPIF_GEN_BUF_SIZE / loop_n) * loop_n;
+	}
+
+	for (i = 0, j = 0; i < loop_len; i++) {
+		EP2FIFOBUF[i] = loop_buf[j];
+		if (++j == loop_n)
+			j = 0;
+	}
+
+	/* Commit the buffer to the GPIF, with the new length (ENH_PKT). */
+	EP2BCH = loop_len >> 8;
+	SYNCDELAY();
+	EP2BCL = loop_len & 0xff;
+	SYNCDELAY();
+}
+
+/*
+ * Test patterns are written into the EP2 buffers by the CPU. The counter
+ * and walking ones patterns repeat every 256 bytes, so the quad buffered
+ * EP2 only has to be filled once and its buffers can then be committed
+ * again and again, as fast as the host reads them. Edge timestamps and
+ * UART bytes are sent by the CPU, too.
+ */
+static bool gpif_pattern_prepare(const struct cmd_start_acquisition *cmd)
+{
+	uint8_t i;
+
+	if (pattern > PATTERN_MAX || cmd->edge_inputs > EDGE_INPUT_MAX ||
+#ifdef FX2LAFW_NO_UART_SNIFFER
+	    uarts ||
+#endif
+	    (edges && uarts)) {
+		pattern = TEST_PATTERN_NONE;
+		edges = false;
+		uarts = false;
+		gpif_info.error = ACQ_ERR_PARAM;
+		return false;
+	}
+
+	/* gpif_acquisition_stop() dropped the stale packets already. */
+	EP2FIFOCFG = 0;
+	SYNCDELAY();
+
+#ifndef FX2LAFW_NO_TEST_PATTERN
+	pattern_left = ((uint32_t)cmd->sample_count[0] << 24) |
+		       ((uint32_t)cmd->sample_count[1] << 16) |
+		       ((uint16_t)cmd->sample_count[2] << 8) |
+		       cmd->sample_count[3];
+	if (cmd->flags & CMD_START_FLAGS_SAMPLE_16BIT)
+		pattern_left <<= 1;
+#endif
+	for (i = 0; i < 4; i++)
+		gpif_info.sample_count[i] = cmd->sample_count[i];
+
+	/* There is no sample clock, report a period of 0. */
+	gpif_info.flags = cmd->flags;
+	gpif_info.period_h = 0;
+	gpif_info.period_l = 0;
+	gpif_info.period_num = 0;
+	gpif_info.period_den = 1;
+	gpif_info.jitter = 0;
+
+	gpif_acquiring = PREPARED;
+
+	return true;
 }
 
+#if !defined(FX2LAFW_NO_TEST_PATTERN) || \
+    !defined(FX2LAFW_NO_EDGE_TIMESTAMPS) || !defined(FX2LAFW_NO_UART_SNIFFER)
+/* Max. packet size of EP2, for the packets committed by the CPU. */
+static uint16_t gpif_packet_size(void)
+{
+	return (USBCS & bmHSM) ? 512 : 64;
+}
+#endif
+
+/*
+ * Packets are filled at a running offset. Four packets of 64 (full speed)
+ * or 512 bytes are a multiple of 256 bytes, so the buffers can still be
+ * committed again and again.
+ */
+#ifndef FX2LAFW_NO_TEST_PATTERN
+static void gpif_pattern_poll(void)
+{
+	uint16_t i, len = gpif_packet_size();
+
+	if (EP2CS & bmEPFULL)
+		return;
+
+	if (pattern_left && pattern_left < len)
+		len = pattern_left;
+
+	if (pattern == TEST_PATTERN_LFSR) {
+		for (i = 0; i < len; i++) {
+			if (pattern_lfsr & 1)
+				pattern_lfsr = (pattern_lfsr >> 1) ^ 0xb400;
+			else
+				pattern_lfsr >>= 1;
+			EP2FIFOBUF[i] = pattern_lfsr & 0xff;
+		}
+	} else if (pattern_fill) {
+		for (i = 0; i < len; i++) {
+			if (pattern == TEST_PATTERN_COUNTER)
+				EP2FIFOBUF[i] = (pattern_pos + i) & 0xff;
+			else
+				EP2FIFOBUF[i] = 1 << ((pattern_pos + i) & 7);
+		}
+		pattern_pos += len;
+		pattern_fill--;
+	}
+
+	EP2BCH = len >> 8;
+	SYNCDELAY();
+	EP2BCL = len & 0xff;
+	SYNCDELAY();
+
+	if (pattern_left) {
+		pattern_left -= len;
+		if (!pattern_left)
+			gpif_acquiring = STOPPED;
+	}
+}
+#endif
+
+#ifndef FX2LAFW_NO_EDGE_TIMESTAMPS
+/*
+ * Called from the INT0 handler only. Reentrant, so its locals aren't
+ * overlaid with those of the main loop (e.g. gpif_ring_flush()).
+ */
+void gpif_record_edge(uint32_t t) __reentrant
+{
+	__xdata struct edge_record *r;
+	uint8_t next = (edge_head + 1) & (GPIF_RING_LEN - 1);
+
+	if (next == edge_tail) {
+		if (edge_lost < 255)
+			edge_lost++;
+		return;
+	}
+
+	r = &edge_ring[edge_head];
+	r->dropped = edge_lost;
+	r->timestamp[0] = t >> 24;
+	r->timestamp[1] = t >> 16;
+	r->timestamp[2] = t >> 8;
+	r->timestamp[3] = t;
+	edge_lost = 0;
+	edge_head = next;
+}
+#endif
+
+#ifndef FX2LAFW_NO_UART_SNIFFER
+/*
+ * Called from the serial port handlers only (same priority). Reentrant,
+ * see gpif_record_edge().
+ */
+void gpif_record_uart(uint8_t flags, uint8_t data, uint32_t t) __reentrant
+{
+	__xdata struct uart_record *r;
+	uint8_t next = (uart_head + 1) & (GPIF_RING_LEN - 1);
+
+	if (next == uart_tail) {
+		uart_lost = true;
+		return;
+	}
+
+	r = &uart_ring[uart_head];
+	r->flags = flags;
+	if (uart_lost)
+		r->flags |= UART_RECORD_DROPPED;
+	r->data = data;
+	r->timestamp[0] = t >> 24;
+	r->timestamp[1] = t >> 16;
+	r->timestamp[2] = t >> 8;
+	r->timestamp[3] = t;
+	uart_lost = false;
+	uart_head = next;
+}
+#endif
+
+#if !defined(FX2LAFW_NO_EDGE_TIMESTAMPS) || !defined(FX2LAFW_NO_UART_SNIFFER)
+/*
+ * Commit the records buffered in a ring (of GPIF_RING_LEN records of size
+ * bytes each) as soon as EP2 has room, as many as fit into a packet.
+ * Returns the new tail.
+ */
+static uint8_t gpif_ring_flush(const __xdata uint8_t *ring, uint8_t size,
+		uint8_t tail, uint8_t head)
+{
+	const __xdata uint8_t *p;
+	uint16_t len = 0, max = gpif_packet_size();
+	uint8_t i;
+
+	if (tail == head || (EP2CS & bmEPFULL))
+		return tail;
+
+	while (tail != head && len + size <= max) {
+		p = ring + tail * size;
+		for (i = 0; i < size; i++)
+			EP2FIFOBUF[len++] = p[i];
+		tail = (tail + 1) & (GPIF_RING_LEN - 1);
+	}
+
+	EP2BCH = len >> 8;
+	SYNCDELAY();
+	EP2BCL = len & 0xff;
+	SYNCDELAY();
+
+	return tail;
+}
+#endif
+
 bool gpif_acquisition_prepare(const struct cmd_start_acquisition *cmd)
 {
 	int i;
 	volatile BYTE *pSTATE = &GPIF_WAVE_DATA;
+	uint8_t sample_delay_l = cmd->sample_delay_l;
+	uint8_t fifocfg = bmAUTOIN;
+	uint8_t num = 0, den = 1;
 
 	/* Ensure GPIF is idle before reconfiguration. */
-	while (!(GPIFTRIG & 0x80));
+	if (!gpif_wait_idle())
+		return false;
+
+	gpif_info.error = ACQ_ERR_NONE;
+
+	pattern = generator ? TEST_PATTERN_NONE : cmd->test_pattern;
+	edges = !generator && cmd->edge_inputs;
+	uarts = !generator &&
+		(cmd->uart_flags & (UART_SNIFF_PORT0 | UART_SNIFF_PORT1));
+#ifndef FX2LAFW_NO_UART_SNIFFER
+	uart_flags = cmd->uart_flags;
+	uart_reload = cmd->uart_reload;
+#endif
+	if (pattern || edges || uarts)
+		return gpif_pattern_prepare(cmd);
+
+	/*
+	 * The pattern generator uses the FIFOWR waveform (index 1). In
+	 * loop mode, the CPU commits the EP2 OUT buffers itself.
+	 */
+	gen_loop = generator && cmd->gen_loop;
+	loop_n = 0;
+	if (generator) {
+		pSTATE += 32;
+		fifocfg = gen_loop ? 0 : bmAUTOOUT;
+	}
 
 	/* Configure the EP2 FIFO. */
 	if (cmd->flags & CMD_START_FLAGS_SAMPLE_16BIT)
-		EP2FIFOCFG = bmAUTOIN | bmWORDWIDE;
-	else
-		EP2FIFOCFG = bmAUTOIN;
+		fifocfg |= bmWORDWIDE;
+	EP2FIFOCFG = fifocfg;
 	SYNCDELAY();
 
-	/* Set IFCONFIG to the correct clock source. */
-	if (cmd->flags & CMD_START_FLAGS_CLK_48MHZ) {
+	/*
+	 * Set IFCONFIG to the correct clock source. An interleave slave
+	 * runs from the master's IFCLK instead, see below.
+	 */
+	if ((cmd->flags & CMD_START_FLAGS_INTERLEAVE) &&
+	    (cmd->flags & CMD_START_FLAGS_SYNC_SLAVE)) {
+		IFCONFIG = bmASYNC | bmGSTATE | bmIFGPIF;
+	} else if (cmd->flags & CMD_START_FLAGS_CLK_48MHZ) {
 		IFCONFIG = bmIFCLKSRC | bm3048MHZ | bmIFCLKOE | bmASYNC |
 			   bmGSTATE | bmIFGPIF;
 	} else {
@@ -208,10 +772,125 @@ bool gpif_acquisition_prepare(const struct cmd_start_acquisition *cmd)
 	}
 
 	/* Populate delay states. */
-	if (cmd->sample_delay_h >= 6)
+	if (cmd->sample_delay_h >= 6) {
+		gpif_info.error = ACQ_ERR_PARAM;
+		return false;
+	}
+
+	period_ticks = 0;
+
+	/*
+	 * A sync master drives CTL0 high for as long as the waveform runs,
+	 * i.e. from the instant the GPIF is started. A sync slave spends S0
+	 * waiting for that edge on RDY0, and loops over S1..Sn afterwards.
+	 * This costs one of the seven states.
+	 */
+	ctl_out = (cmd->flags & CMD_START_FLAGS_SYNC_MASTER) ? 0x01 : 0x00;
+	loop_start = 0;
+	if (cmd->flags & CMD_START_FLAGS_SYNC_SLAVE) {
+		if (cmd->sample_delay_h >= 5) {
+			gpif_info.error = ACQ_ERR_PARAM;
+			return false;
+		}
+		gpif_make_sync_wait_state(pSTATE++);
+		loop_start = 1;
+	}
+
+	/*
+	 * Interleaving: the slave's samples have to lie halfway between
+	 * the master's ones. With a sample period of p ticks, delay the
+	 * start of the sampling loop by p / 2 ticks once, and for odd p
+	 * additionally sample on the falling edge of the shared IFCLK.
+	 * The slave only sees CTL0 on RDY0 GPIF_SYNC_LATENCY ticks late,
+	 * which is taken off the delay. Short periods don't leave enough
+	 * ticks for that, the slave then lags by more whole periods. The
+	 * offset actually achieved is reported in the stream tag.
+	 * Only supported for periods up to 512 ticks without fractions.
+	 */
+	tag_pending = (cmd->flags & CMD_START_FLAGS_INTERLEAVE) != 0;
+	tag_role = loop_start;
+	tag_offset = 0;
+	if (tag_pending && loop_start) {
+		uint16_t p = ((uint16_t)cmd->sample_delay_h << 8) +
+			     sample_delay_l + 1;
+		int16_t delay;
+
+		if (p > 512 || cmd->sample_delay_frac) {
+			gpif_info.error = ACQ_ERR_PARAM;
+			return false;
+		}
+		if (p & 1)
+			IFCONFIG |= bmIFCLKPOL;
+		delay = (int16_t)(p >> 1) - GPIF_SYNC_LATENCY;
+		while (delay < 0)
+			delay += p;
+		if (delay) {
+			gpif_make_delay_state(pSTATE++, delay, 0x00);
+			loop_start++;
+			period_ticks = 0;
+		}
+		tag_offset = 2 * (delay + GPIF_SYNC_LATENCY) + (p & 1);
+	}
+
+	/*
+	 * Unlimited acquisitions run a single endless transaction and stop
+	 * when the FIFO is full (i.e. the host stopped reading):
+	 * LFUNC=0 (AND), TERMA=6 (FIFO Flag), TERMB=6 (FIFO Flag)
+	 *
+	 * Sample limited ones load the sample count into the transaction
+	 * count and additionally stop when it expires. TCXRDY5 replaces RDY5
+	 * by the TCXpire signal:
+	 * LFUNC=1 (OR), TERMA=6 (FIFO Flag), TERMB=5 (TCXpire)
+	 */
+	for (i = 0; i < 4; i++)
+		sample_count[i] = cmd->sample_count[i];
+	if (cmd->sample_count[0] | cmd->sample_count[1] |
+	    cmd->sample_count[2] | cmd->sample_count[3]) {
+		GPIFREADYCFG = (1 << 5);
+		dp_logic = (1 << 6) | (6 << 3) | (5 << 0);
+	} else {
+		GPIFREADYCFG = 0;
+		dp_logic = (6 << 3) | (6 << 0);
+
+		/*
+		 * SOF events need a running sample index, let the (unused)
+		 * transaction count run down from its maximum.
+		 */
+		if (cmd->sof_interval) {
+			for (i = 0; i < 4; i++)
+				sample_count[i] = 0xff;
+		}
+	}
+
+	/*
+	 * Fractional periods are only supported for periods that fit into
+	 * a single state (2..255 ticks) and without the CTL2 clock output.
+	 */
+	if (cmd->sample_delay_frac && !cmd->sample_delay_h && !generator &&
+	    sample_delay_l && !(cmd->flags & CMD_START_FLAGS_CLK_CTL2)) {
+		num = gpif_frac_approx(cmd->sample_delay_frac,
+				       GPIF_FRAC_DEN_MAX - loop_start, &den);
+		if (num == den) {
+			num = 0;
+			if (sample_delay_l < 255)
+				sample_delay_l++;
+		}
+		if (num == 0 || sample_delay_l == 255)
+			den = 1;
+	}
+
+	if (den > 1 && (dp_logic & (1 << 6)) && !gpif_round_count(den)) {
+		gpif_info.error = ACQ_ERR_PARAM;
 		return false;
+	}
+	for (i = 0; i < 4; i++) {
+		gpif_info.sample_count[i] =
+			(dp_logic & (1 << 6)) ? sample_count[i] : 0;
+	}
 
-	if (cmd->flags & CMD_START_FLAGS_CLK_CTL2) {
+	if (den > 1) {
+		gpif_make_frac_states(pSTATE, sample_delay_l + 1, num, den);
+	} else if (cmd->flags & CMD_START_FLAGS_CLK_CTL2) {
 		uint8_t delay_1, delay_2 = cmd->sample_delay_l;
 
 		/* We need a pulse where the CTL1/2 pins alternate states. */
@@ -230,12 +909,25 @@ bool gpif_acquisition_prepare(const struct cmd_start_acquisition *cmd)
 		for (i = 0; i < cmd->sample_delay_h; i++)
 			gpif_make_delay_state(pSTATE++, 0, 0x00);
 
-		if (cmd->sample_delay_l != 0)
-			gpif_make_delay_state(pSTATE++, cmd->sample_delay_l, 0x00);
+		if (sample_delay_l != 0)
+			gpif_make_delay_state(pSTATE++, sample_delay_l, 0x00);
 	}
 
 	/* Populate S1 - the decision point. */
-	gpif_make_data_dp_state(pSTATE++);
+	if (den == 1)
+		gpif_make_data_dp_state(pSTATE++);
+
+	/*
+	 * Record what was actually built, for CMD_GET_ACQUISITION_INFO.
+	 * period_ticks holds the length of a whole pass (den samples).
+	 */
+	gpif_info.flags = cmd->flags;
+	gpif_info.period_num = period_ticks % den;
+	gpif_info.period_den = den;
+	gpif_info.jitter = (den > 1) ? 1 : 0;
+	period_ticks /= den;
+	gpif_info.period_h = period_ticks >> 8;
+	gpif_info.period_l = period_ticks & 0xff;
 
 	/* Update the status. */
 	gpif_acquiring = PREPARED;
@@ -243,42 +935,353 @@ bool gpif_acquisition_prepare(const struct cmd_start_acquisition *cmd)
 	return true;
 }
 
-void gpif_acquisition_start(void)
+/*
+ * Commit a short in-band marker (segment_marker, stream_tag) as a
+ * CPU-sourced EP2 packet. The caller ensures that a buffer is free.
+ */
+static void gpif_commit_marker(uint8_t magic_1, uint8_t a, uint8_t b,
+		uint8_t c, uint8_t len)
 {
-	/* Execute the whole GPIF waveform once. */
-	gpif_set_tc16(1);
+	BYTE cfg = EP2FIFOCFG;
 
-	/* Perform the initial GPIF read. */
-	gpif_fifo_read(GPIF_EP2);
+	EP2FIFOCFG = cfg & ~bmAUTOIN;
+	SYNCDELAY();
+	EP2FIFOBUF[0] = SEGMENT_MARKER_MAGIC_0;
+	EP2FIFOBUF[1] = magic_1;
+	EP2FIFOBUF[2] = a;
+	EP2FIFOBUF[3] = b;
+	EP2FIFOBUF[4] = c;
+	EP2BCH = 0;
+	SYNCDELAY();
+	EP2BCL = len;
+	SYNCDELAY();
+	EP2FIFOCFG = cfg;
+	SYNCDELAY();
+}
+
+bool gpif_acquisition_start(void)
+{
+	/* gpif_fifo_read() would spin forever on a wedged GPIF. */
+	if (!gpif_wait_idle())
+		return false;
+
+	/* The generator has nothing to output yet, gpif_poll() retries. */
+	if (generator && (EP2FIFOFLGS & (1 << 1)))
+		return false;
+
+#ifndef FX2LAFW_NO_EDGE_TIMESTAMPS
+	/* Timestamp falling edges on INT0, with high priority. */
+	if (edges) {
+		edge_head = edge_tail = 0;
+		edge_lost = 0;
+		OEA &= ~bmINT0;
+		PORTACFG |= bmINT0;
+		IT0 = 1;
+		IE0 = 0;
+		PX0 = 1;
+		EX0 = 1;
+		gpif_acquiring = RUNNING;
+		return true;
+	}
+#endif
+
+#ifndef FX2LAFW_NO_UART_SNIFFER
+	if (uarts) {
+		uart_head = uart_tail = 0;
+		uart_lost = false;
+
+		/* Timer1: 8 bit auto-reload, the baud rate generator. */
+		TR1 = 0;
+		TMOD = (TMOD & 0x0f) | 0x20;
+		if (uart_flags & UART_SNIFF_T1_DIV4)
+			CKCON |= (1 << 4);
+		else
+			CKCON &= ~(1 << 4);
+		TH1 = uart_reload;
+		TL1 = uart_reload;
+		TR1 = 1;
+
+		UART230 = ((uart_flags & UART_SNIFF_FAST0) ? 0x01 : 0) |
+			  ((uart_flags & UART_SNIFF_FAST1) ? 0x02 : 0);
+		if (uart_flags & UART_SNIFF_SMOD0)
+			PCON |= 0x80;
+		else
+			PCON &= ~0x80;
+		SMOD1 = (uart_flags & UART_SNIFF_SMOD1) ? 1 : 0;
+
+		/* Mode 1 (8N1, timer baud rate), receiver enabled. */
+		SCON0 = (uart_flags & UART_SNIFF_PORT0) ? 0x50 : 0x00;
+		SCON1 = (uart_flags & UART_SNIFF_PORT1) ? 0x50 : 0x00;
+		ES0 = (uart_flags & UART_SNIFF_PORT0) ? 1 : 0;
+		ES1 = (uart_flags & UART_SNIFF_PORT1) ? 1 : 0;
+
+		gpif_acquiring = RUNNING;
+		return true;
+	}
+#endif
+
+#ifndef FX2LAFW_NO_TEST_PATTERN
+	if (pattern) {
+		pattern_fill = 4;
+		pattern_pos = 0;
+		pattern_lfsr = 0xffff;
+		gpif_acquiring = RUNNING;
+		return true;
+	}
+#endif
+
+	/*
+	 * Execute the whole GPIF waveform once, or let the transaction
+	 * count run down once per sample for sample limited acquisitions.
+	 */
+	if (sample_count[0] | sample_count[1] |
+	    sample_count[2] | sample_count[3]) {
+		GPIFTCB3 = sample_count[0];
+		SYNCDELAY();
+		GPIFTCB2 = sample_count[1];
+		SYNCDELAY();
+		GPIFTCB1 = sample_count[2];
+		SYNCDELAY();
+		GPIFTCB0 = sample_count[3];
+		SYNCDELAY();
+	} else {
+		gpif_set_tc16(1);
+	}
+
+	/* Tag interleaved streams before their first sample. */
+	if (tag_pending) {
+		gpif_commit_marker(STREAM_TAG_MAGIC_1, tag_role,
+				   tag_offset >> 8, tag_offset & 0xff,
+				   sizeof(struct stream_tag));
+		tag_pending = false;
+	}
+
+	/* Perform the initial GPIF read (or write). */
+	if (generator)
+		gpif_fifo_write(GPIF_EP2);
+	else
+		gpif_fifo_read(GPIF_EP2);
 
 	/* Update the status. */
 	gpif_acquiring = RUNNING;
+
+	return true;
+}
+
+/*
+ * Return the number of samples taken so far, derived from the transaction
+ * count. Only valid for sample limited acquisitions, or if sof_interval
+ * was set. Called from sof_isr(), so its locals must not be overlaid with
+ * those of the main loop.
+ */
+uint32_t gpif_sample_index(void) __reentrant
+{
+	uint32_t tc, start;
+	BYTE b0, b1, b2, b3;
+
+	/* Re-read if the upper bytes changed while reading the lower one. */
+	do {
+		b3 = GPIFTCB3;
+		b2 = GPIFTCB2;
+		b1 = GPIFTCB1;
+		b0 = GPIFTCB0;
+	} while (b1 != GPIFTCB1 || b2 != GPIFTCB2 || b3 != GPIFTCB3);
+
+	tc = ((uint32_t)b3 << 24) | ((uint32_t)b2 << 16) |
+	     ((uint16_t)b1 << 8) | b0;
+	start = ((uint32_t)sample_count[0] << 24) |
+		((uint32_t)sample_count[1] << 16) |
+		((uint16_t)sample_count[2] << 8) | sample_count[3];
+
+	return start - tc;
+}
+
+/* Edge timestamps use INT0 from CMD_START until they are stopped. */
+bool gpif_edges_active(void)
+{
+	return edges;
+}
+
+bool gpif_acquisition_queue(const struct cmd_start_acquisition *cmd)
+{
+	uint8_t i;
+	BYTE *p = (BYTE *)&queue[queue_len];
+
+	/*
+	 * SOF events keep the interval set by CMD_START, so don't accept
+	 * (and silently ignore) another one.
+	 */
+	if (cmd->sof_interval) {
+		gpif_info.error = ACQ_ERR_PARAM;
+		return false;
+	}
+
+	if (queue_len == GPIF_QUEUE_LEN) {
+		gpif_info.error = ACQ_ERR_QUEUE_FULL;
+		return false;
+	}
+
+	for (i = 0; i < sizeof(struct cmd_start_acquisition); i++)
+		p[i] = ((const BYTE *)cmd)[i];
+	queue_len++;
+
+	return true;
+}
+
+static void gpif_queue_clear(void)
+{
+	queue_len = 0;
+	segment = 0;
+	marker_pending = false;
+}
+
+/*
+ * Stop the acquisition, on CMD_STOP or before a new CMD_START. The CPU
+ * sourced modes never end on their own (except for sample limited test
+ * patterns). Data the host didn't read yet is dropped, except for data
+ * it sent ahead to the stopped pattern generator.
+ */
+void gpif_acquisition_stop(void)
+{
+	/* Stop recording edges and bytes, PA0 is a plain I/O again. */
+	if (edges) {
+		EX0 = 0;
+		PORTACFG &= ~bmINT0;
+	}
+	if (uarts) {
+		ES0 = 0;
+		ES1 = 0;
+		SCON0 = 0x00;
+		SCON1 = 0x00;
+	}
+	pattern = TEST_PATTERN_NONE;
+	edges = false;
+	uarts = false;
+
+	GPIFABORT = 0xff;
+	SYNCDELAY();
+
+	if (!generator || gpif_acquiring != STOPPED)
+		gpif_reset_fifo();
+	draining = false;
+	gpif_queue_clear();
+	gpif_acquiring = STOPPED;
+}
+
+/* Commit the segment marker and start the next queued configuration. */
+static void gpif_next_segment(void)
+{
+	uint8_t i, n;
+	bool ok;
+
+	/* Wait for a free buffer, the host may still be reading. */
+	if (EP2CS & bmEPFULL)
+		return;
+	marker_pending = false;
+
+	gpif_commit_marker(SEGMENT_MARKER_MAGIC_1, ++segment, queue[0].flags,
+			   0, sizeof(struct segment_marker));
+
+	/*
+	 * prepare() restores AUTOIN and the FIFO width. Don't let
+	 * ibn_isr() start the PREPARED segment in between, too.
+	 */
+	__critical {
+		ok = gpif_acquisition_prepare(&queue[0]) &&
+		     gpif_acquisition_start();
+	}
+	if (!ok) {
+		gpif_reset_fifo();
+		gpif_queue_clear();
+		gpif_acquiring = STOPPED;
+		return;
+	}
+
+	/* Pop the queue head. */
+	n = (queue_len - 1) * sizeof(struct cmd_start_acquisition);
+	for (i = 0; i < n; i++)
+		((BYTE *)queue)[i] = ((BYTE *)queue)[i + sizeof(queue[0])];
+	queue_len--;
 }
 
 void gpif_poll(void)
 {
-	/* Detect if acquisition has completed. */
-	if ((gpif_acquiring == RUNNING) && (GPIFTRIG & 0x80)) {
-		/* Activate NAK-ALL to avoid race conditions. */
-		FIFORESET = 0x80;
-		SYNCDELAY();
+	/* The GPIF is idle, don't mistake that for the end of a capture. */
+	if (pattern || edges || uarts) {
+		if (gpif_acquiring != RUNNING)
+			return;
+#ifndef FX2LAFW_NO_EDGE_TIMESTAMPS
+		if (edges) {
+			edge_tail = gpif_ring_flush(
+					(__xdata uint8_t *)edge_ring,
+					sizeof(struct edge_record),
+					edge_tail, edge_head);
+			return;
+		}
+#endif
+#ifndef FX2LAFW_NO_UART_SNIFFER
+		if (uarts) {
+			uart_tail = gpif_ring_flush(
+					(__xdata uint8_t *)uart_ring,
+					sizeof(struct uart_record),
+					uart_tail, uart_head);
+			return;
+		}
+#endif
+#ifndef FX2LAFW_NO_TEST_PATTERN
+		gpif_pattern_poll();
+#endif
+		return;
+	}
 
-		/* Switch to manual mode. */
-		EP2FIFOCFG = 0;
-		SYNCDELAY();
+	if (generator) {
+		if (gen_loop && gpif_acquiring != STOPPED)
+			gpif_loop_poll();
 
-		/* Reset EP2. */
-		FIFORESET = 0x02;
-		SYNCDELAY();
+		/* Start once the first data arrived in the EP2 FIFO. */
+		if (gpif_acquiring == PREPARED)
+			gpif_acquisition_start();
+	}
 
-		/* Return to auto mode. */
-		EP2FIFOCFG = bmAUTOIN;
-		SYNCDELAY();
+	if (marker_pending) {
+		gpif_next_segment();
+		return;
+	}
 
-		/* Release NAK-ALL. */
-		FIFORESET = 0x00;
-		SYNCDELAY();
+	/* Stop once the host read the tail of the acquisition. */
+	if (draining) {
+		if (EP2CS & bmEPEMPTY) {
+			draining = false;
+			gpif_reset_fifo();
+			gpif_queue_clear();
+			gpif_acquiring = STOPPED;
+		}
+		return;
+	}
+
+	/* Detect if acquisition has completed. */
+	if ((gpif_acquiring == RUNNING) && (GPIFTRIG & 0x80)) {
+		/*
+		 * If the sample count expired (rather than the FIFO running
+		 * full), flush the last packet. If another configuration is
+		 * queued, continue with it. Otherwise only reset the FIFO
+		 * (and report STOPPED) once the host read all of the data.
+		 */
+		if (!generator && (dp_logic & (1 << 6)) &&
+		    !(GPIFTCB3 | GPIFTCB2 | GPIFTCB1 | GPIFTCB0)) {
+			INPKTEND = 0x02;
+			SYNCDELAY();
+			if (queue_len) {
+				marker_pending = true;
+				gpif_next_segment();
+			} else {
+				draining = true;
+			}
+			return;
+		}
 
+		gpif_reset_fifo();
+		gpif_queue_clear();
 		gpif_acquiring = STOPPED;
 	}
 }
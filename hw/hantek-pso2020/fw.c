@@ -48,7 +48,16 @@
 
 #define OUT0 ((1 << CTL_BIT) << 4) /* OEx = 1, CTLx = 0 */
 
+/*
+ * Assumption, not verified against a schematic or on hardware: ADC
+ * channel B samples on the opposite IFCLK edge, so streaming both
+ * channels at 48MHz would give 96 MS/s (see set_voltage()). If both
+ * ADCs sample on the same edge, rate 96 is plain 2x 48 MS/s instead.
+ */
+#define INTERLEAVED_RATE 96
+
 static const struct samplerate_info samplerates[] = {
+	{ 96, 0x80,   0, 3, 0, 0x00, 0xea },
 	{ 48, 0x80,   0, 3, 0, 0x00, 0xea },
 	{ 30, 0x80,   0, 3, 0, 0x00, 0xaa },
 	{ 24,    1,   0, 2, 1, OUT0, 0xca },
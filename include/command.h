@@ -26,11 +26,30 @@
 #define CMD_GET_FW_VERSION		0xb0
 #define CMD_START			0xb1
 #define CMD_GET_REVID_VERSION		0xb2
+#define CMD_GET_CAPABILITIES		0xb3
+#define CMD_GET_ACQUISITION_INFO	0xb4
+#define CMD_QUEUE_ACQUISITION		0xb5
+#define CMD_SET_FREQ_METER		0xb6
+#define CMD_STOP			0xb7
 
+/*
+ * CMD_STOP ends the acquisition, including the edge timestamp, UART sniffer
+ * and unlimited test pattern modes, which don't end on their own. Data the
+ * host didn't read yet is dropped. CMD_START implies it.
+ */
+
+#define CMD_START_FLAGS_IMMEDIATE_POS	0
+#define CMD_START_FLAGS_SYNC_MASTER_POS	1
+#define CMD_START_FLAGS_SYNC_SLAVE_POS	2
+#define CMD_START_FLAGS_INTERLEAVE_POS	3
 #define CMD_START_FLAGS_CLK_CTL2_POS	4
 #define CMD_START_FLAGS_WIDE_POS	5
 #define CMD_START_FLAGS_CLK_SRC_POS	6
 
+#define CMD_START_FLAGS_IMMEDIATE	(1 << CMD_START_FLAGS_IMMEDIATE_POS)
+#define CMD_START_FLAGS_SYNC_MASTER	(1 << CMD_START_FLAGS_SYNC_MASTER_POS)
+#define CMD_START_FLAGS_SYNC_SLAVE	(1 << CMD_START_FLAGS_SYNC_SLAVE_POS)
+#define CMD_START_FLAGS_INTERLEAVE	(1 << CMD_START_FLAGS_INTERLEAVE_POS)
 #define CMD_START_FLAGS_CLK_CTL2	(1 << CMD_START_FLAGS_CLK_CTL2_POS)
 #define CMD_START_FLAGS_SAMPLE_8BIT	(0 << CMD_START_FLAGS_WIDE_POS)
 #define CMD_START_FLAGS_SAMPLE_16BIT	(1 << CMD_START_FLAGS_WIDE_POS)
@@ -38,15 +57,306 @@
 #define CMD_START_FLAGS_CLK_30MHZ	(0 << CMD_START_FLAGS_CLK_SRC_POS)
 #define CMD_START_FLAGS_CLK_48MHZ	(1 << CMD_START_FLAGS_CLK_SRC_POS)
 
+#define CAPS_FLAGS_CLK_48MHZ		(1 << 0)
+#define CAPS_FLAGS_HIGH_SPEED		(1 << 1)
+#define CAPS_FLAGS_FRAC_PERIOD		(1 << 2)
+#define CAPS_FLAGS_SAMPLE_COUNT		(1 << 3)
+#define CAPS_FLAGS_SOF_EVENTS		(1 << 4)
+#define CAPS_FLAGS_TEST_PATTERN		(1 << 5)
+#define CAPS_FLAGS_GENERATOR		(1 << 6)
+#define CAPS_FLAGS_EDGE_TIMESTAMPS	(1 << 7)
+
+#define CAPS_FLAGS2_LOOPBACK		(1 << 0)
+#define CAPS_FLAGS2_FREQ_METER		(1 << 1)
+#define CAPS_FLAGS2_UART_SNIFFER	(1 << 2)
+#define CAPS_FLAGS2_STOP		(1 << 3)
+
+/*
+ * Synthetic test patterns, sent instead of the pin data. The patterns are
+ * byte oriented (also with 16 bit samples), byte n of the stream being:
+ * COUNTER: n & 0xff
+ * WALKING_ONES: 1 << (n & 7)
+ * LFSR: the low byte of a 16 bit Galois LFSR (taps 0xb400, initial state
+ * 0xffff), shifted once before each byte.
+ */
+#define TEST_PATTERN_NONE		0
+#define TEST_PATTERN_COUNTER		1
+#define TEST_PATTERN_WALKING_ONES	2
+#define TEST_PATTERN_LFSR		3
+
+/* Inputs for edge timestamps (edge_inputs of cmd_start_acquisition). */
+#define EDGE_INPUT_INT0			(1 << 0)
+
+/*
+ * UART sniffer (uart_flags of cmd_start_acquisition). Each enabled port
+ * receives 8N1 on its RXD pin, at 2^SMODn * 115200 baud if FASTn is set,
+ * else at 2^SMODn * 48MHz / (32 * (T1_DIV4 ? 4 : 12) * (256 - uart_reload))
+ * (timer1 is shared by both ports).
+ */
+#define UART_SNIFF_PORT0		(1 << 0)
+#define UART_SNIFF_PORT1		(1 << 1)
+#define UART_SNIFF_SMOD0		(1 << 2)
+#define UART_SNIFF_SMOD1		(1 << 3)
+#define UART_SNIFF_FAST0		(1 << 4)
+#define UART_SNIFF_FAST1		(1 << 5)
+#define UART_SNIFF_T1_DIV4		(1 << 6)
+
+/* uart_record flags */
+#define UART_RECORD_PORT1		(1 << 0)
+#define UART_RECORD_FRAMING_ERROR	(1 << 1)
+#define UART_RECORD_DROPPED		(1 << 7)
+
+/* First bytes of the in-band marker that precedes each queued segment. */
+#define SEGMENT_MARKER_MAGIC_0		0xa5
+#define SEGMENT_MARKER_MAGIC_1		0x5a
+
+/* First bytes of the stream tag sent before interleaved captures. */
+#define STREAM_TAG_MAGIC_0		0xa5
+#define STREAM_TAG_MAGIC_1		0x5b
+
+/* acquisition_info error codes */
+#define ACQ_ERR_NONE			0
+#define ACQ_ERR_PARAM			1
+#define ACQ_ERR_GPIF_TIMEOUT		2
+#define ACQ_ERR_QUEUE_FULL		3
+
+/* Hosts may omit the optional trailing fields of cmd_start_acquisition. */
+#define CMD_START_LEN_MIN		3
+#define CMD_START_LEN_MAX		sizeof(struct cmd_start_acquisition)
+
 struct version_info {
 	uint8_t major;
 	uint8_t minor;
 };
 
+/*
+ * Reply to CMD_GET_CAPABILITIES. Multi-byte values are sent MSB first.
+ * The board name (not NUL-terminated) follows directly after the struct.
+ */
+struct capabilities_info {
+	uint8_t major;
+	uint8_t minor;
+	/* CMD_START_FLAGS_* bits understood by this firmware. */
+	uint8_t start_flags;
+	/* CAPS_FLAGS_* (currently selected IFCLK, current bus speed). */
+	uint8_t flags;
+	/* CAPS_FLAGS2_*, the remaining bits are reserved (0). */
+	uint8_t flags2;
+	/* Achievable rates: IFCLK / period, period_min..period_max ticks. */
+	uint8_t period_min_h;
+	uint8_t period_min_l;
+	uint8_t period_max_h;
+	uint8_t period_max_l;
+	/*
+	 * Max. sustained samplerate in kHz:
+	 * [0] = HS 8bit, [1] = HS 16bit, [2] = FS 8bit, [3] = FS 16bit.
+	 */
+	uint8_t max_rate_khz[4][2];
+	/* EP2 FIFO: number of buffers and size of a single buffer. */
+	uint8_t fifo_bufs;
+	uint8_t fifo_size_h;
+	uint8_t fifo_size_l;
+	/* Max. number of configurations CMD_QUEUE_ACQUISITION accepts. */
+	uint8_t queue_depth;
+	uint8_t name_len;
+};
+
+/*
+ * Reply to CMD_GET_ACQUISITION_INFO, describing the waveform that was
+ * actually built by the last CMD_START. The achieved samplerate is
+ * exactly IFCLK / period, with IFCLK selected by the CLK_48MHZ flag.
+ */
+struct acquisition_info {
+	/* STOPPED (0), PREPARED (1) or RUNNING (2). */
+	uint8_t status;
+	/* CMD_START_FLAGS_* the waveform was built with. */
+	uint8_t flags;
+	/* Sample period in IFCLK ticks: period + period_num / period_den. */
+	uint8_t period_h;
+	uint8_t period_l;
+	uint8_t period_num;
+	uint8_t period_den;
+	/* Max. deviation of a sample from the ideal sample grid, in ticks. */
+	uint8_t jitter;
+	/*
+	 * ACQ_ERR_* of the last CMD_START, acquisition start or rejected
+	 * CMD_QUEUE_ACQUISITION.
+	 */
+	uint8_t error;
+	/*
+	 * Time from processing CMD_START to starting the GPIF, in units
+	 * of 0.25us (MSB first). Without CMD_START_FLAGS_IMMEDIATE the
+	 * GPIF is only started on the first bulk IN request of the host.
+	 */
+	uint8_t start_delay[4];
+	/* Sample count actually used (MSB first), 0 means unlimited. */
+	uint8_t sample_count[4];
+};
+
 struct cmd_start_acquisition {
 	uint8_t flags;
 	uint8_t sample_delay_h;
 	uint8_t sample_delay_l;
+	/* Optional: additional delay in 1/256 IFCLK ticks. */
+	uint8_t sample_delay_frac;
+	/*
+	 * Optional: number of samples (MSB first) after which the
+	 * acquisition ends, or switches to the next queued configuration.
+	 * 0 means unlimited. With fractional periods it is rounded up to
+	 * a multiple of period_den, see acquisition_info.
+	 */
+	uint8_t sample_count[4];
+	/*
+	 * Optional: send an EVENT_SOF every n (micro)frames, 0 = never.
+	 * Must be 0 for CMD_QUEUE_ACQUISITION, the interval set by
+	 * CMD_START applies to all segments.
+	 */
+	uint8_t sof_interval;
+	/*
+	 * Optional: TEST_PATTERN_*. The pattern is produced by the CPU
+	 * as fast as the host reads it, the sample period is ignored.
+	 * sample_count still ends the acquisition.
+	 */
+	uint8_t test_pattern;
+	/*
+	 * Optional, pattern generator (alternate setting 1) only: repeat
+	 * the first packet sent to EP2 OUT (up to GEN_LOOP_MAX bytes),
+	 * instead of outputting the data streamed by the host. Each further
+	 * packet (zero-length ones will do) is replaced by 512 bytes worth
+	 * of whole repetitions of the pattern.
+	 */
+	uint8_t gen_loop;
+	/*
+	 * Optional: EDGE_INPUT_*. Instead of samples, stream the time of
+	 * each falling edge on the selected inputs as edge_record.
+	 */
+	uint8_t edge_inputs;
+	/* Optional: UART_SNIFF_* and timer1 reload value, see above. */
+	uint8_t uart_flags;
+	uint8_t uart_reload;
+};
+
+/*
+ * Pattern generator: in alternate setting 1 of interface 0, EP2 is an OUT
+ * endpoint. CMD_START then configures the GPIF to drive the data sent by
+ * the host onto port B (and D) with the given sample period. Output starts
+ * once the first data arrived and stops when the host doesn't keep up
+ * (or after sample_count samples).
+ */
+#define GEN_LOOP_MAX			64
+
+/*
+ * Event records sent on the EP1 IN (interrupt) endpoint. EP1 IN and OUT only
+ * exist in alternate setting 2 of interface 0 (otherwise identical to 0),
+ * so SOF events and CMD_SET_FREQ_METER need that setting.
+ */
+#define EVENT_SOF			0x01
+#define EVENT_LOOPBACK			0x02
+#define EVENT_FREQ			0x03
+
+/*
+ * Sent every sof_interval (micro)frames while an acquisition is running.
+ * sample_index is the index of the sample taken at the time the SOF
+ * interrupt was serviced (MSB first). Records that could not be sent
+ * because the host didn't read the previous one are counted in dropped.
+ */
+struct event_sof {
+	uint8_t type;
+	uint8_t dropped;
+	uint8_t frame_h;
+	uint8_t frame_l;
+	uint8_t microframe;
+	uint8_t sample_index[4];
+};
+
+/*
+ * UART sniffer records, sent on EP2 instead of samples. data was received
+ * on the port given by the flags, at timestamp (units of 0.25us, MSB
+ * first, taken in the middle of the stop bit). UART_RECORD_DROPPED is set
+ * if bytes were lost before this one.
+ */
+struct uart_record {
+	uint8_t flags;
+	uint8_t data;
+	uint8_t timestamp[4];
+};
+
+/*
+ * CMD_SET_FREQ_METER (wValue: gate time in ms, 0 = off, max. 8191) makes
+ * the firmware measure the signal on INT0 (PA0) and send this record at
+ * the end of each gate time. edges is the number of falling edges, span
+ * the time from the first to the last of them, high the time the input
+ * was high and window the exact gate time, in units of 0.25us (MSB
+ * first). So period = span / (edges - 1), frequency = 1 / period and
+ * duty cycle = high / window. Records the host didn't fetch in time are
+ * counted in dropped. CMD_START stops the measurement. The command is
+ * rejected (stalled) during edge timestamp acquisitions, which use INT0.
+ */
+struct event_freq {
+	uint8_t type;
+	uint8_t dropped;
+	uint8_t edges[4];
+	uint8_t span[4];
+	uint8_t high[4];
+	uint8_t window[4];
+};
+
+/*
+ * Edge timestamp records, sent on EP2 instead of samples. The falling
+ * edges on INT0 (PA0) are timestamped by the CPU in the interrupt handler
+ * (high priority), in units of 0.25us (MSB first). The timestamp wraps
+ * around after ca. 1074s. Edges that couldn't be buffered are counted in
+ * dropped of the next record (saturating at 255).
+ */
+struct edge_record {
+	uint8_t dropped;
+	uint8_t timestamp[4];
+};
+
+/*
+ * Every packet the host sends to the EP1 OUT (bulk) endpoint is echoed
+ * on EP1 IN, prefixed by this header, for measuring round trip latencies.
+ * timestamp is the device time the packet was echoed at, in units of
+ * 0.25us (MSB first). The len bytes of payload follow the header, longer
+ * packets are truncated to LOOPBACK_PAYLOAD_MAX bytes.
+ */
+struct event_loopback {
+	uint8_t type;
+	uint8_t len;
+	uint8_t timestamp[4];
+};
+
+#define LOOPBACK_PAYLOAD_MAX		(64 - sizeof(struct event_loopback))
+
+/*
+ * When a sample limited acquisition ends and another configuration was
+ * queued with CMD_QUEUE_ACQUISITION, the last data packet of the segment
+ * is committed as a short (possibly zero-length) packet, followed by this
+ * marker in a packet of its own. The samples of the next segment follow.
+ */
+struct segment_marker {
+	uint8_t magic[2];
+	/* Index of the segment that follows, the first one has index 0. */
+	uint8_t segment;
+	/* CMD_START_FLAGS_* of the segment that follows. */
+	uint8_t flags;
+};
+
+/*
+ * With CMD_START_FLAGS_INTERLEAVE, this tag is sent in a packet of its
+ * own before the first sample. The sync master (role 0) outputs IFCLK
+ * and samples as usual. The sync slave (role 1) runs from the master's
+ * IFCLK, fed into its IFCLK pin, and takes sample n offset half ticks
+ * after the master's sample n, so the host can merge both streams.
+ * This includes the latency of the sync input, so for periods below 4
+ * ticks the offset is larger than a single period.
+ */
+struct stream_tag {
+	uint8_t magic[2];
+	uint8_t role;
+	/* Offset to the master's samples, in half IFCLK ticks. */
+	uint8_t offset_h;
+	uint8_t offset_l;
 };
 
 #endif
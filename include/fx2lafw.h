@@ -37,7 +37,20 @@
  * longer (properly) work with the new fx2lafw firmware.
  */
 #define FX2LAFW_VERSION_MAJOR	1
-#define FX2LAFW_VERSION_MINOR	4
+#define FX2LAFW_VERSION_MINOR	5
+
+/*
+ * The optional modes can be left out of the logic analyzer firmware, e.g.
+ * if it doesn't fit into a smaller FX2 variant. FX2LAFW_NO_EXTRAS (see
+ * configure --disable-la-extras) leaves out all of them. The host sees
+ * which ones are built in from CMD_GET_CAPABILITIES.
+ */
+#ifdef FX2LAFW_NO_EXTRAS
+#define FX2LAFW_NO_TEST_PATTERN
+#define FX2LAFW_NO_EDGE_TIMESTAMPS
+#define FX2LAFW_NO_FREQ_METER
+#define FX2LAFW_NO_UART_SNIFFER
+#endif
 
 #define LED_POLARITY		1 /* 1: active-high, 0: active-low */
 
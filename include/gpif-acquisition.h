@@ -23,16 +23,49 @@
 #include <stdbool.h>
 #include <command.h>
 
+/* Sample period limits in IFCLK ticks (up to five 256 tick delay states). */
+#define GPIF_PERIOD_MIN	1
+#define GPIF_PERIOD_MAX	(5 * 256 + 255 + 1)
+
+/*
+ * IFCLK ticks from a sync master raising CTL0 until its slaves see RDY0
+ * (the RDY inputs are synchronized to IFCLK in asynchronous mode).
+ */
+#define GPIF_SYNC_LATENCY	2
+
+/* Max. number of polls (ca. 1us each) to wait for the GPIF to get idle. */
+#define GPIF_IDLE_TIMEOUT	10000
+
+/* Max. number of samples per waveform pass for fractional periods. */
+#define GPIF_FRAC_DEN_MAX	6
+
+/* Max. number of configurations waiting in the acquisition queue. */
+#define GPIF_QUEUE_LEN		4
+
+/* Size of the EP2 OUT buffers in pattern generator mode. */
+#define GPIF_GEN_BUF_SIZE	512
+
+/* Number of edge timestamps or UART bytes buffered (power of two). */
+#define GPIF_RING_LEN		16
+
 enum gpif_status {
 	STOPPED = 0,
 	PREPARED,
 	RUNNING,
 };
 extern enum gpif_status gpif_acquiring;
+extern __xdata struct acquisition_info gpif_info;
 
 void gpif_init_la(void);
+void gpif_set_generator(bool on);
 bool gpif_acquisition_prepare(const struct cmd_start_acquisition *cmd);
-void gpif_acquisition_start(void);
+bool gpif_acquisition_start(void);
+void gpif_acquisition_stop(void);
+bool gpif_edges_active(void);
+bool gpif_acquisition_queue(const struct cmd_start_acquisition *cmd);
+uint32_t gpif_sample_index(void) __reentrant;
+void gpif_record_edge(uint32_t t) __reentrant;
+void gpif_record_uart(uint8_t flags, uint8_t data, uint32_t t) __reentrant;
 void gpif_poll(void);
 
 #endif